@@ -1,15 +1,18 @@
 #include "MyTcpHandler.hpp"
+#include "Deduplicator.hpp"
 #include <iostream>
 #include <thread>
 #include <chrono>
 #include <random>
 #include <string>
+#include <cstdlib>
 
 using namespace iot_service;
 
 // Locally defined functions and variables
 namespace {
 	constexpr int MIN_TEMP = 20, MAX_TEMP = 26;
+	constexpr const char* DEFAULT_DEVICE_ID = "simulator-1";
 	
 	void InitMessagingWithController(AMQP::TcpChannel& channel) {
 		// Declare a queue and exchange
@@ -19,6 +22,13 @@ namespace {
 		// Bind the DataSimulator queue to the exchange with the routing key
 		channel.bindQueue(mqbroker::Exchange, mqbroker::DataSimulatorQueue, mqbroker::DSQueueRoutingKey);
 	}
+	
+	uint64_t GetInitialSequence() {
+		// Start from the current time in milliseconds, so the sequence keeps growing 
+		// across restarts (as long as less than 1000 messages per second are sent)
+		auto now = std::chrono::system_clock::now().time_since_epoch();
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(now).count());
+	}
 }
 
 int main(int argc, char* argv[]) {
@@ -34,10 +44,17 @@ int main(int argc, char* argv[]) {
 	std::random_device dev;
 	std::mt19937 gen(dev());
 	std::uniform_int_distribution<std::mt19937::result_type> temp_gen(MIN_TEMP, MAX_TEMP);
+	
+	// Identity of the readings (to let consumers drop redelivered ones)
+	const char* device_id = std::getenv("DEVICE_ID");
+	ReadingId reading_id{ device_id ? device_id : DEFAULT_DEVICE_ID, GetInitialSequence() };
 
 	while (true) {
-		int temperature = temp_gen(gen);
-		channel.publish(mqbroker::Exchange, mqbroker::DSQueueRoutingKey, std::to_string(temperature));
+		std::string temperature = std::to_string(temp_gen(gen));
+		AMQP::Envelope envelope(temperature.data(), temperature.size());
+		SetReadingId(envelope, reading_id);
+		channel.publish(mqbroker::Exchange, mqbroker::DSQueueRoutingKey, envelope);
+		++reading_id.sequence;
 		
 		handler.processEvents(&connection);
 				
@@ -0,0 +1,181 @@
+#ifndef DEDUPLICATOR_HPP
+#define DEDUPLICATOR_HPP
+
+#include "amqpcpp.h"
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <optional>
+#include <unordered_map>
+#include <list>
+#include <functional>
+#include <mutex>
+#include <algorithm>
+
+namespace iot_service {
+	// Names of AMQP message headers that identify a reading
+	namespace headers {
+		constexpr std::string_view DeviceId = "device_id";
+		constexpr std::string_view Sequence = "sequence";
+		constexpr std::string_view Timestamp = "timestamp_ms";		// Original time of the reading (milliseconds since epoch)
+	}
+
+	// Identity of a reading: the device that produced it and its sequence number
+	// (positive and increasing per device; Data Simulator starts from the current time in milliseconds)
+	struct ReadingId {
+		std::string device_id;
+		uint64_t sequence = 0;
+	};
+
+	// Attach the reading identity (and its original time, if known) to the outgoing message headers
+	inline void SetReadingId(AMQP::Envelope& envelope, const ReadingId& reading_id, std::optional<int64_t> timestamp_ms = std::nullopt) {
+		AMQP::Table table;
+		table.set(std::string(headers::DeviceId), AMQP::LongString(reading_id.device_id));
+		table.set(std::string(headers::Sequence), AMQP::ULongLong(reading_id.sequence));
+		if (timestamp_ms) {
+			table.set(std::string(headers::Timestamp), AMQP::LongLong(*timestamp_ms));
+		}
+		envelope.setHeaders(table);
+	}
+
+	// Read the reading identity from the message headers (if the producer set them)
+	inline std::optional<ReadingId> GetReadingId(const AMQP::Message& message) {
+		const AMQP::Table& table = message.headers();
+		const AMQP::Field& device_id = table.get(std::string(headers::DeviceId));
+		const AMQP::Field& sequence = table.get(std::string(headers::Sequence));
+		if (!device_id.isString() || !sequence.isInteger()) {
+			return std::nullopt;
+		}
+
+		ReadingId reading_id{ static_cast<const std::string&>(device_id), static_cast<uint64_t>(sequence) };
+		if (reading_id.sequence == 0) {
+			return std::nullopt;
+		}
+		return reading_id;
+	}
+	
+	// Read the original time of the reading from the message headers (set by Replayer)
+	inline std::optional<int64_t> GetReadingTimestamp(const AMQP::Message& message) {
+		const AMQP::Field& timestamp_ms = message.headers().get(std::string(headers::Timestamp));
+		if (!timestamp_ms.isInteger()) {
+			return std::nullopt;
+		}
+		return static_cast<int64_t>(timestamp_ms);
+	}
+
+	// Result of checking a sequence number against a window
+	enum class SequenceStatus {
+		Accepted,		// Seen for the first time
+		Duplicate,		// Already seen
+		Stale			// Too far behind the high-water mark to tell (may be a real reading delivered out of order)
+	};
+
+	// Sliding window over the last 64 sequence numbers of a single device.
+	// Bit i of the bitmap is set if the sequence number (high_ - i) has already been seen.
+	class SequenceWindow {
+	public:
+		static constexpr uint64_t Size = 64;
+
+		SequenceWindow() = default;
+		SequenceWindow(uint64_t high, uint64_t bitmap) : high_(high), bitmap_(bitmap) {}
+
+		// Record the sequence number if it is seen for the first time
+		SequenceStatus Accept(uint64_t sequence) {
+			if (sequence > high_) {
+				uint64_t shift = sequence - high_;
+				bitmap_ = (shift >= Size) ? 0 : (bitmap_ << shift);
+				bitmap_ |= 1;
+				high_ = sequence;
+				return SequenceStatus::Accepted;
+			}
+
+			uint64_t offset = high_ - sequence;
+			if (offset >= Size) {
+				return SequenceStatus::Stale;
+			}
+			uint64_t mask = uint64_t{1} << offset;
+			if (bitmap_ & mask) {
+				return SequenceStatus::Duplicate;
+			}
+			bitmap_ |= mask;
+			return SequenceStatus::Accepted;
+		}
+
+		uint64_t HighWater() const {
+			return high_;
+		}
+
+		uint64_t Bitmap() const {
+			return bitmap_;
+		}
+
+	private:
+		uint64_t high_ = 0;		// The highest sequence number seen so far (0 - nothing seen yet)
+		uint64_t bitmap_ = 0;	// Seen flags of the sequence numbers below (and including) high_
+	};
+
+	// Loads the window of a device that is not cached (first reading after a restart or after eviction)
+	using WindowLoader = std::function<SequenceWindow(const std::string&)>;
+
+	// Drops redelivered readings before they are stored or evaluated by the rules.
+	// Windows are cached for the most recently seen devices only (about 150 bytes per device,
+	// plus twice the length of long device IDs); the rest are rebuilt by the loader when their readings arrive again.
+	class Deduplicator {
+	public:
+		static constexpr std::size_t DefaultCapacity = 1'000'000;
+
+		explicit Deduplicator(std::size_t capacity = DefaultCapacity) : capacity_(std::max<std::size_t>(capacity, 1)) {}
+
+		// Check the reading against its device window (and record it if accepted).
+		// The updated window is copied to 'window' (if given) to let the caller persist it.
+		SequenceStatus Accept(const ReadingId& reading_id, const WindowLoader& loader, SequenceWindow* window = nullptr) {
+			{
+				std::lock_guard<std::mutex> lock(windows_mutex_);
+				auto it = windows_.find(reading_id.device_id);
+				if (it != windows_.end()) {
+					return AcceptCached(it->second, reading_id.sequence, window);
+				}
+			}
+
+			// Load the window without holding the lock (it may query the database)
+			SequenceWindow loaded = loader(reading_id.device_id);
+
+			std::lock_guard<std::mutex> lock(windows_mutex_);
+			auto it = windows_.find(reading_id.device_id);
+			if (it == windows_.end()) {
+				// Cache the window (evicting the least recently used one if needed)
+				if (windows_.size() >= capacity_) {
+					windows_.erase(lru_.back());
+					lru_.pop_back();
+				}
+				lru_.push_front(reading_id.device_id);
+				it = windows_.emplace(reading_id.device_id, CachedWindow{ loaded, lru_.begin() }).first;
+			}
+			return AcceptCached(it->second, reading_id.sequence, window);
+		}
+
+	private:
+		struct CachedWindow {
+			SequenceWindow window;
+			std::list<std::string>::iterator lru_position;
+		};
+
+		SequenceStatus AcceptCached(CachedWindow& cached, uint64_t sequence, SequenceWindow* window) {
+			// Mark the device as the most recently used one
+			lru_.splice(lru_.begin(), lru_, cached.lru_position);
+
+			SequenceStatus status = cached.window.Accept(sequence);
+			if (window) {
+				*window = cached.window;
+			}
+			return status;
+		}
+
+		std::unordered_map<std::string, CachedWindow> windows_;		// Map device IDs to their windows
+		std::list<std::string> lru_;								// Device IDs from the most to the least recently used
+		std::mutex windows_mutex_;
+		std::size_t capacity_;
+	};
+}
+
+#endif 	// DEDUPLICATOR_HPP
@@ -1,4 +1,5 @@
 #include "MyTcpHandler.hpp"
+#include "Deduplicator.hpp"
 #include <iostream>
 #include <thread>
 #include <unordered_map>
@@ -9,6 +10,9 @@
 #include <functional>
 #include <chrono>
 #include <string>
+#include <optional>
+#include <cstdint>
+#include <bsoncxx/builder/basic/document.hpp>
 #include <bsoncxx/json.hpp>
 #include <mongocxx/client.hpp>
 #include <mongocxx/instance.hpp>
@@ -28,12 +32,39 @@ namespace {
 		// Initialize db and collection (or just access them)
 		auto iot_db = client[DatabaseName];
 		auto temp_values_collection = iot_db[mqbroker::DataSimulatorQueue];
-		// Clear the content of collection (to return empty one)
-		temp_values_collection.delete_many({});
+		// Keep the stored values (they back the sequence windows after a restart) and index them by device
+		temp_values_collection.create_index(bsoncxx::builder::basic::make_document(
+			bsoncxx::builder::basic::kvp("DeviceId", 1),
+			bsoncxx::builder::basic::kvp("Sequence", -1)
+		));
 		
 		return temp_values_collection;
 	}
 	
+	SequenceWindow LoadSequenceWindow(mongocxx::v_noabi::collection& temp_values_collection, const std::string& device_id) {
+		// Rebuild the window from the latest stored values of the device
+		mongocxx::options::find options;
+		options.sort(bsoncxx::builder::basic::make_document(bsoncxx::builder::basic::kvp("Sequence", -1)));
+		options.limit(static_cast<std::int64_t>(SequenceWindow::Size));
+		
+		SequenceWindow window;
+		auto cursor = temp_values_collection.find(bsoncxx::builder::basic::make_document(
+			bsoncxx::builder::basic::kvp("DeviceId", device_id)), options);
+		for (auto&& document : cursor) {
+			window.Accept(static_cast<uint64_t>(document["Sequence"].get_int64().value));
+		}
+		return window;
+	}
+	
+	bool IsReadingStored(mongocxx::v_noabi::collection& temp_values_collection, const ReadingId& reading_id) {
+		// Look the reading up by the (DeviceId, Sequence) index
+		mongocxx::options::find options;
+		options.projection(bsoncxx::builder::basic::make_document(bsoncxx::builder::basic::kvp("_id", 1)));
+		return static_cast<bool>(temp_values_collection.find_one(bsoncxx::builder::basic::make_document(
+			bsoncxx::builder::basic::kvp("DeviceId", reading_id.device_id),
+			bsoncxx::builder::basic::kvp("Sequence", static_cast<std::int64_t>(reading_id.sequence))), options));
+	}
+	
 	void InitMessagingWithRuleEngine(AMQP::TcpChannel& channel) {
 		// Declare the queue with RuleEngine to redirect temperature values to it
 		channel.declareExchange(mqbroker::Exchange, AMQP::direct);
@@ -43,6 +74,18 @@ namespace {
 	}
 }
 
+// Message received from Data Simulator along with its identity (if the producer set it)
+struct ReceivedMessage {
+	std::string body;
+	std::optional<ReadingId> reading_id;
+	std::optional<int64_t> timestamp_ms;		// Original time of the reading (if replayed from an archive)
+	bool redelivered = false;
+	AMQP::TcpChannel* channel = nullptr;		// The channel to acknowledge the message on
+	uint64_t delivery_tag = 0;
+};
+
+using ProcessMessageFunction = std::function<void(const ReceivedMessage&, mongocxx::v_noabi::collection&, AMQP::TcpChannel&)>;
+
 class ThreadPool {
 public:
     ThreadPool() : stop_flag_(false) {
@@ -53,7 +96,7 @@ public:
         Stop();
     }
 
-    void EnqueueMessage(const std::string& message) {
+    void EnqueueMessage(const ReceivedMessage& message) {
         {
             std::lock_guard<std::mutex> lock(queue_mutex_);
             message_queue_.push(message);
@@ -93,13 +136,33 @@ public:
         thread_map_.clear();
     }
 	
-	void SetProcessMessageFunction(std::function<void(const std::string&, mongocxx::v_noabi::collection&, AMQP::TcpChannel&)> process_message_functor) {
+	void SetProcessMessageFunction(ProcessMessageFunction process_message_functor) {
 		process_message_ = process_message_functor;
 	}
 	
 	void SetAmqpTcpConnection(AMQP::TcpConnection* connection) {
 		rabbitmq_connection_ = connection;
 	}
+	
+	// Queue a channel operation (publish, ack) to the thread that processes the connection events
+	// (AMQP-CPP is not thread-safe, so worker threads must not use the connection directly)
+	void PostConnectionTask(std::function<void()> task) {
+		std::lock_guard<std::mutex> lock(connection_tasks_mutex_);
+		connection_tasks_.push(std::move(task));
+	}
+	
+	// Run the queued channel operations (called by the thread that processes the connection events)
+	void RunConnectionTasks() {
+		std::queue<std::function<void()>> tasks;
+		{
+			std::lock_guard<std::mutex> lock(connection_tasks_mutex_);
+			std::swap(tasks, connection_tasks_);
+		}
+		while (!tasks.empty()) {
+			tasks.front()();
+			tasks.pop();
+		}
+	}
 
 private:
     void WorkerThread() {
@@ -118,8 +181,9 @@ private:
 		channel.consume(mqbroker::DataSimulatorQueue).onReceived([&](const AMQP::Message &message,
 												  uint64_t deliveryTag,
 												  bool redelivered) {
-			// Extract the message body (temperature value)
-			std::string received_message(message.body(), message.bodySize());
+			// Extract the message body (temperature value) and its identity
+			ReceivedMessage received_message{ std::string(message.body(), message.bodySize()), GetReadingId(message), 
+											  GetReadingTimestamp(message), redelivered, &channel, deliveryTag };
 			std::cout << std::this_thread::get_id() << " - " << "Received a message from Data Simulator" << std::endl;
 			this->EnqueueMessage(received_message);
 		});
@@ -128,7 +192,7 @@ private:
 		InitMessagingWithRuleEngine(channel);
 		
         while (true) {
-            std::string message;
+            ReceivedMessage message;
             {
                 std::unique_lock<std::mutex> lock(queue_mutex_);
                 queue_condition_.wait(lock, [this] { return !message_queue_.empty() || stop_flag_; });
@@ -149,14 +213,17 @@ private:
 
     std::unordered_map<std::thread::id, std::thread> thread_map_;	// Map thread IDs to thread objects
 	
-    std::queue<std::string> message_queue_;
+    std::queue<ReceivedMessage> message_queue_;
     std::mutex queue_mutex_;
     std::condition_variable queue_condition_;
     std::mutex pool_mutex_;
     std::atomic<bool> stop_flag_;
 	
-	std::function<void(const std::string&, mongocxx::v_noabi::collection&, AMQP::TcpChannel&)> process_message_;
+	ProcessMessageFunction process_message_;
 	AMQP::TcpConnection* rabbitmq_connection_;
+	
+	std::queue<std::function<void()>> connection_tasks_;
+	std::mutex connection_tasks_mutex_;
 };
 
 void MonitorMessageRateAndAdjustThreads(ThreadPool& thread_pool) {
@@ -202,6 +269,21 @@ int main() {
                            .Help("IoT controller counter")
                            .Register(*registry);
 	auto& message_counter = counter_family.Add({{"message_counter", "value"}});
+	// Create a counter of duplicate readings (not stored again)
+	auto& duplicate_counter_family = BuildCounter()
+                           .Name("iot_controller_duplicates_counter")
+                           .Help("IoT controller duplicate readings counter")
+                           .Register(*registry);
+	auto& duplicate_counter = duplicate_counter_family.Add({{"duplicate_counter", "value"}});
+	// Create a counter of stale readings (too far behind the window, checked in the database)
+	auto& stale_counter_family = BuildCounter()
+                           .Name("iot_controller_stale_counter")
+                           .Help("IoT controller stale readings counter")
+                           .Register(*registry);
+	auto& stale_counter = stale_counter_family.Add({{"stale_counter", "value"}});
+	
+	// Sequence windows per device (shared by all worker threads)
+	Deduplicator deduplicator;
 
 	// Launch monitoring thread (to adjust worker threads)
 	using namespace std::chrono_literals;
@@ -212,28 +294,66 @@ int main() {
 	thread_pool.SetAmqpTcpConnection(&connection);
 
 	// Set function to process messages
-	thread_pool.SetProcessMessageFunction([&message_counter](const std::string& message, 
+	thread_pool.SetProcessMessageFunction([&thread_pool, &message_counter, &duplicate_counter, &stale_counter, &deduplicator](const ReceivedMessage& message, 
 															mongocxx::v_noabi::collection& temp_values_collection, AMQP::TcpChannel& channel) {
-		int temperature = std::stoi(message);
-		
-		// Log reception of temperature
-		Logger::Info(R"({"service":"IoT Controller", "level":"info", "message":"Received a temperature"})");
-		
-		// Update message_counter value (Prometheus)
-		message_counter.Increment();
-		
-		// Get the current time
-		auto now = std::chrono::system_clock::now();
-		auto bson_date = bsoncxx::types::b_date{ now };		// Convert to BSON format
-		
+		// Check whether the reading has already been stored (not to store it again)
+		bool already_stored = false;
+		if (message.reading_id) {
+			auto status = deduplicator.Accept(*message.reading_id, [&temp_values_collection](const std::string& device_id) {
+				return LoadSequenceWindow(temp_values_collection, device_id);
+			});
+			if (status == SequenceStatus::Stale) {
+				// Too far behind the window (e.g. reordered by the worker threads) - ask the database
+				stale_counter.Increment();
+				already_stored = IsReadingStored(temp_values_collection, *message.reading_id);
+			} else {
+				already_stored = (status == SequenceStatus::Duplicate);
+			}
+		}
 		
-		// Insert the current time point (date and stuff) and temperature value into collection
-		temp_values_collection.insert_one(bsoncxx::builder::basic::make_document(
-			bsoncxx::builder::basic::kvp("Temperature", temperature),
-			bsoncxx::builder::basic::kvp("Time", bson_date)
-		));
+		if (already_stored) {
+			duplicate_counter.Increment();
+			Logger::Warn(std::format(R"({{"service":"IoT Controller", "level":"warn", "message":"Skipped storing a duplicate reading", "redelivered":{}}})", 
+				message.redelivered));
+		} else {
+			int temperature = std::stoi(message.body);
+			
+			// Log reception of temperature
+			Logger::Info(R"({"service":"IoT Controller", "level":"info", "message":"Received a temperature"})");
+			
+			// Update message_counter value (Prometheus)
+			message_counter.Increment();
+			
+			// Get the original time of the reading (or the current time)
+			auto now = std::chrono::system_clock::now();
+			auto bson_date = message.timestamp_ms 
+				? bsoncxx::types::b_date{ std::chrono::milliseconds{ *message.timestamp_ms } } 
+				: bsoncxx::types::b_date{ now };		// Convert to BSON format
+			
+			// Insert the current time point (date and stuff) and temperature value into collection
+			// (along with the reading identity to rebuild the sequence windows from)
+			bsoncxx::builder::basic::document document;
+			document.append(bsoncxx::builder::basic::kvp("Temperature", temperature));
+			document.append(bsoncxx::builder::basic::kvp("Time", bson_date));
+			if (message.reading_id) {
+				document.append(bsoncxx::builder::basic::kvp("DeviceId", message.reading_id->device_id));
+				document.append(bsoncxx::builder::basic::kvp("Sequence", static_cast<std::int64_t>(message.reading_id->sequence)));
+			}
+			temp_values_collection.insert_one(document.view());
+		}
 		
-		channel.publish(mqbroker::Exchange, mqbroker::REQueueRoutingKey, message);
+		// Forward the temperature along with its identity even if it is a duplicate (the previous 
+		// delivery may have been stored but not forwarded; Rule Engine drops duplicates by itself),
+		// then acknowledge the message - both on the connection thread
+		AMQP::TcpChannel* publish_channel = &channel;
+		thread_pool.PostConnectionTask([publish_channel, message]() {
+			AMQP::Envelope envelope(message.body.data(), message.body.size());
+			if (message.reading_id) {
+				SetReadingId(envelope, *message.reading_id, message.timestamp_ms);
+			}
+			publish_channel->publish(mqbroker::Exchange, mqbroker::REQueueRoutingKey, envelope);
+			message.channel->ack(message.delivery_tag);
+		});
 		
 		// Log sending of temperature
 		Logger::Info(R"({"service":"IoT Controller", "level":"info", "message":"Sent a temperature"})");
@@ -241,6 +361,7 @@ int main() {
 	
 	while (true) {
 		handler.processEvents(&connection);
+		thread_pool.RunConnectionTasks();
 	}
 	
 	monitor_thread.join();
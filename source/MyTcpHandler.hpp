@@ -74,12 +74,12 @@ public:
         close(epoll_fd);
     }
 	
-	// Process events of fd in the epoll loop
-    void processEvents(AMQP::TcpConnection* connection) {
+	// Process events of fd in the epoll loop (waiting up to timeout_ms for them)
+    void processEvents(AMQP::TcpConnection* connection, int timeout_ms = 0) {
         const int MAX_EVENTS = 10;
         struct epoll_event events[MAX_EVENTS];
 
-		int num_events = epoll_wait(epoll_fd, events, MAX_EVENTS, 0);
+		int num_events = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout_ms);
 		for (int i = 0; i < num_events; ++i) {
 			int fd = events[i].data.fd;
 			if (events[i].events & EPOLLIN) {